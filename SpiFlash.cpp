@@ -7,9 +7,11 @@ uint8_t SpiFlash::transfer(uint8_t value) {
 
 void SpiFlash::select_chip() {
   SPI.beginTransaction(spi_settings_);
+  SpiFlashBase::select_chip();
 }
 
 void SpiFlash::deselect_chip() {
+  SpiFlashBase::deselect_chip();
   SPI.endTransaction();
 }
 
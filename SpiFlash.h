@@ -6,6 +6,12 @@
 #include "SpiFlashBase.h"
 
 
+/* Flash on the hardware SPI bus.
+ *
+ * **NOTE** `select_chip()` and `deselect_chip()` drive `/CS` (i.e.,
+ * `cs_pin`) within each SPI transaction, so callers must not toggle `/CS`
+ * themselves.
+ */
 class SpiFlash : public SpiFlashBase {
 protected:
   SPISettings spi_settings_;
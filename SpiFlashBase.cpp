@@ -18,6 +18,8 @@ void SpiFlashBase::begin() {
   manufacturer_id_ = transfer(0);
   device_id_ = transfer(0);
   deselect_chip();
+
+  detect_addressing();
 }
 
 void SpiFlashBase::begin(uint8_t cs_pin) {
@@ -25,6 +27,93 @@ void SpiFlashBase::begin(uint8_t cs_pin) {
   begin();
 }
 
+/*
+ * # Command #
+ *
+ *  1. Shift out: `[instruction]`
+ *  2. Shift out address, depending on address mode:
+ *      * 3-byte: `[A23-A16][A15-A8][A7-A0]`
+ *      * 4-byte: `[A31-A24][A23-A16][A15-A8][A7-A0]`
+ *
+ * **NOTE** Chip must already be selected.
+ */
+void SpiFlashBase::command(uint8_t instruction, uint32_t address) {
+  transfer(instruction);
+  if (address_bytes_ == 4) {
+    transfer(address >> (3 * 8));  // A31-A24
+  }
+  transfer(address >> (2 * 8));  // A23-A16
+  transfer(address >> (1 * 8));  // A15-A8
+  transfer(address);  // A7-A0
+}
+
+/*
+ * # Detect capacity and address mode #
+ *
+ *  1. Read capacity and supported address modes from the JEDEC Basic Flash
+ *     Parameter Table (see JEDEC `JESD216`), if the SFDP signature is found.
+ *  2. Otherwise, use capacity byte of JEDEC ID (i.e., `2^N` bytes).
+ *  3. Use 4-byte addresses for parts larger than 16MB (i.e., the limit of
+ *     24-bit addressing), entering 4-byte address mode unless the part only
+ *     supports 4-byte addresses.
+ *
+ * If 4-byte address mode cannot be entered, `capacity()` is limited to the
+ * lower 16MB (i.e., the range reachable with 3-byte addresses), and the
+ * error code is left set (`TIMEOUT_ERROR` or `ADDRESS_MODE_ERROR`).
+ */
+void SpiFlashBase::detect_addressing() {
+  uint8_t header[16];
+  uint8_t address_modes = SFDP__ADDRESS_3_BYTE;
+
+  address_bytes_ = 3;
+  capacity_ = 0;
+
+  read_sfdp(0, header, sizeof(header));
+  const uint32_t signature = (static_cast<uint32_t>(header[3]) << 24 |
+                              static_cast<uint32_t>(header[2]) << 16 |
+                              static_cast<uint32_t>(header[1]) << 8 |
+                              header[0]);
+  /* Parameter header 0 (at offset 8) describes the Basic Flash Parameter
+   * Table (ID LSB `0x00`):
+   *
+   *     [ID LSB][minor][major][length][PTP A7-A0][PTP A15-A8][PTP A23-A16]
+   *     [ID MSB]
+   */
+  if (signature == SFDP__SIGNATURE && header[8] == 0x00) {
+    const uint32_t table_address = (static_cast<uint32_t>(header[14]) << 16 |
+                                    static_cast<uint32_t>(header[13]) << 8 |
+                                    header[12]);
+    uint8_t table[8];
+
+    read_sfdp(table_address, table, sizeof(table));
+    // DWORD 1, bits 18:17: supported address modes.
+    address_modes = (table[2] >> 1) & 0b11;
+    /* DWORD 2: density (in bits), either `N + 1` or (if bit 31 is set)
+     * `2^N`. */
+    const uint32_t density = (static_cast<uint32_t>(table[7]) << 24 |
+                              static_cast<uint32_t>(table[6]) << 16 |
+                              static_cast<uint32_t>(table[5]) << 8 |
+                              table[4]);
+    if (!(density & 0x80000000)) {
+      capacity_ = (density >> 3) + 1;
+    } else if ((density & 0x7FFFFFFF) >= 3 && (density & 0x7FFFFFFF) < 35) {
+      capacity_ = 1UL << ((density & 0x7FFFFFFF) - 3);
+    }
+  }
+  if (capacity_ == 0) {
+    const uint8_t capacity_code = jedec_id();
+    if (capacity_code >= 0x10 && capacity_code < 0x20) {
+      capacity_ = 1UL << capacity_code;
+    }
+  }
+
+  if (address_modes == SFDP__ADDRESS_4_BYTE) {
+    address_bytes_ = 4;
+  } else if (capacity_ > (1UL << 24) && !enter_4_byte_address_mode()) {
+    capacity_ = 1UL << 24;
+  }
+}
+
 /*
  * # Read status register 1 #
  *
@@ -59,6 +148,23 @@ uint8_t SpiFlashBase::status_register2() {
   return status;
 }
 
+/*
+ * # Read status register 3 #
+ *
+ *  1. Select chip
+ *  2. Send `Read Status Register-3`:
+ *      * Shift out: `[0x15]`
+ *      * Shift out `[0xXX]`, shift in `status`
+ *  3. Deselect chip
+ */
+uint8_t SpiFlashBase::status_register3() {
+  select_chip();
+  transfer(INSTR__READ_STATUS_REGISTER_3);
+  uint8_t status = transfer(0);
+  deselect_chip();
+  return status;
+}
+
 bool SpiFlashBase::ready() {
   return !(status_register1() & STATUS__BUSY);
 }
@@ -86,12 +192,9 @@ bool SpiFlashBase::read(uint32_t address, uint8_t *dst, uint32_t length) {
   //  2. Select chip
   select_chip();
   /*  3. Send `Read Data`
-   *      * Shift out: `[0x03]` */
-  transfer(INSTR__READ_DATA);
-  //      * Shift out: `[A23-A16][A15-A8][A7-A0]`
-  transfer(address >> (2 * 8));  // A23-A16
-  transfer(address >> (1 * 8));  // A15-A8
-  transfer(address);  // A7-A0
+   *      * Shift out: `[0x03]`
+   *      * Shift out address (see "Command") */
+  command(INSTR__READ_DATA, address);
   //  4. Shift out `[0xXX]`, shift in value
   //  5. Repeat 4 to read bytes as needed.
   for (uint32_t i = 0; i < length; i++) {
@@ -183,12 +286,9 @@ bool SpiFlashBase::write_page(uint32_t address, uint8_t *src, uint32_t length) {
   select_chip();
   /*  3. Send `Page Program`
    *      * Shift out: `[0x02]`
-   *      * Shift out: `[A23-A16][A15-A8][A7-A0]`
+   *      * Shift out address (see "Command")
    */
-  transfer(INSTR__PAGE_PROGRAM);
-  transfer(address >> (2 * 8));  // A23-A16
-  transfer(address >> (1 * 8));  // A15-A8
-  transfer(address);  // A7-A0
+  command(INSTR__PAGE_PROGRAM, address);
   /*  4. Shift out `N` bytes
    *      * **NOTE** bytes will be written to:
    *
@@ -227,6 +327,74 @@ bool SpiFlashBase::write_page(uint32_t address, UInt8Array src) {
   return write_page(address, src.data, src.length);
 }
 
+/*
+ * # Write (any number of bytes) #
+ *
+ * Split write into page program operations that do not cross a 256-byte
+ * page boundary (see "Write page" above for wrapping behaviour).
+ */
+bool SpiFlashBase::write(uint32_t address, uint8_t *src, uint32_t length) {
+  while (length > 0) {
+    uint32_t count = PAGE_SIZE - (address % PAGE_SIZE);
+    if (count > length) { count = length; }
+    if (!write_page(address, src, count)) { return false; }
+    address += count;
+    src += count;
+    length -= count;
+  }
+  return true;
+}
+
+/*
+ * # Blank check #
+ *
+ * Stream bytes using a single `Read Data` instruction, stopping at the first
+ * byte that is not erased (i.e., not `0xFF`).
+ */
+bool SpiFlashBase::is_blank(uint32_t address, uint32_t length) {
+  if (!ready_wait()) { return false; }
+
+  select_chip();
+  command(INSTR__READ_DATA, address);
+  bool blank = true;
+  for (uint32_t i = 0; i < length; i++) {
+    if (transfer(0) != 0xFF) {
+      blank = false;
+      break;
+    }
+  }
+  deselect_chip();
+  clear_error();
+  return blank;
+}
+
+/*
+ * # Program check #
+ *
+ * Stream bytes using a single `Read Data` instruction, stopping at the first
+ * byte with a bit that is cleared in `src` but still set on flash.
+ *
+ * **NOTE** Page program can only clear bits, so bits that are *set* in `src`
+ * are not checked (i.e., programming over non-erased bytes is supported).
+ */
+bool SpiFlashBase::is_programmed(uint32_t address, uint8_t *src,
+                                 uint32_t length) {
+  if (!ready_wait()) { return false; }
+
+  select_chip();
+  command(INSTR__READ_DATA, address);
+  bool programmed = true;
+  for (uint32_t i = 0; i < length; i++) {
+    if (transfer(0) & ~src[i]) {
+      programmed = false;
+      break;
+    }
+  }
+  deselect_chip();
+  clear_error();
+  return programmed;
+}
+
 uint32_t SpiFlashBase::jedec_id() {
   select_chip();
   transfer(INSTR__JEDEC_ID);
@@ -243,10 +411,8 @@ uint32_t SpiFlashBase::jedec_id() {
 uint64_t SpiFlashBase::read_unique_id() {
   select_chip();
   transfer(INSTR__READ_UNIQUE_ID);
-  transfer(SPI__DUMMY);
-  transfer(SPI__DUMMY);
-  transfer(SPI__DUMMY);
-  transfer(SPI__DUMMY);
+  // One dummy byte per address byte, plus one (i.e., 4 or 5 dummy bytes).
+  for (uint8_t i = 0; i < address_bytes_ + 1; i++) { transfer(SPI__DUMMY); }
 
   uint64_t result = 0;
 
@@ -258,13 +424,34 @@ uint64_t SpiFlashBase::read_unique_id() {
   return result;
 }
 
-uint8_t SpiFlashBase::read_sfdp_register(uint8_t address) {
+/*
+ * # Read SFDP #
+ *
+ *  1. Select chip
+ *  2. Send `Read SFDP Register`:
+ *      * Shift out: `[0x5A][A23-A16][A15-A8][A7-A0][dummy]`
+ *      * **NOTE** SFDP addresses are always 3 bytes (i.e., independent of
+ *        address mode).
+ *  3. Shift out `[0xXX]`, shift in value (repeat as needed)
+ *  4. Deselect chip
+ */
+void SpiFlashBase::read_sfdp(uint32_t address, uint8_t *dst,
+                             uint32_t length) {
   select_chip();
   transfer(INSTR__READ_SFDP_REGISTER);
-  transfer(0);
-  transfer(0);
-  uint8_t result = transfer(SPI__DUMMY);
+  transfer(address >> (2 * 8));  // A23-A16
+  transfer(address >> (1 * 8));  // A15-A8
+  transfer(address);  // A7-A0
+  transfer(SPI__DUMMY);
+  for (uint32_t i = 0; i < length; i++) {
+    dst[i] = transfer(SPI__DUMMY);
+  }
   deselect_chip();
+}
+
+uint8_t SpiFlashBase::read_sfdp_register(uint8_t address) {
+  uint8_t result = 0;
+  read_sfdp(address, &result, 1);
   return result;
 }
 
@@ -273,9 +460,7 @@ bool SpiFlashBase::erase(uint32_t address, uint8_t code,
   if (!ready_wait() || !enable_write()) { return false; }
 
   select_chip();
-  transfer(address >> (2 * 8));
-  transfer(address >> (1 * 8));
-  transfer(address);
+  command(code, address);
   deselect_chip();
 
   /* Wait for sector erase to complete.
@@ -297,6 +482,45 @@ bool SpiFlashBase::erase(uint32_t address, uint8_t code,
   return true;
 }
 
+/*
+ * # Enter 4-byte address mode #
+ *
+ * All instructions with an address (e.g., `Read Data`, `Page Program`,
+ * `Sector Erase`) take 4 address bytes (see "Command") until
+ * `exit_4_byte_address_mode()` is called or the chip is reset.
+ */
+bool SpiFlashBase::enter_4_byte_address_mode() {
+  if (!ready_wait()) { return false; }
+
+  select_chip();
+  transfer(INSTR__ENTER_4_BYTE_ADDRESS_MODE);
+  deselect_chip();
+  // Verify expected state of `ADS` bit in status register 3.
+  if (!(status_register3() & STATUS3__ADDRESS_MODE)) {
+    set_error(ADDRESS_MODE_ERROR);
+    return false;
+  }
+  address_bytes_ = 4;
+  clear_error();
+  return true;
+}
+
+bool SpiFlashBase::exit_4_byte_address_mode() {
+  if (!ready_wait()) { return false; }
+
+  select_chip();
+  transfer(INSTR__EXIT_4_BYTE_ADDRESS_MODE);
+  deselect_chip();
+  // Verify expected state of `ADS` bit in status register 3.
+  if (status_register3() & STATUS3__ADDRESS_MODE) {
+    set_error(ADDRESS_MODE_ERROR);
+    return false;
+  }
+  address_bytes_ = 3;
+  clear_error();
+  return true;
+}
+
 bool SpiFlashBase::erase_sector(uint32_t address) {
   /* **TODO** **TODO** **TODO** **TODO** **TODO** **TODO** **TODO** **TODO**
    *
@@ -380,6 +604,11 @@ void SpiFlashBase::reset() {
   select_chip();
   transfer(INSTR__RESET);
   deselect_chip();
+
+  /* Wait for reset to complete, then restore address mode (reset returns
+   * to default 3-byte address mode). */
+  delayMicroseconds(30);
+  detect_addressing();
 }
 
 void SpiFlashBase::release_powerdown() {
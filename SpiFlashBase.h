@@ -48,6 +48,11 @@
  *     | Reset                      | 99h     |              |             |           |           |            |
  *     |----------------------------|---------|--------------|-------------|-----------|-----------|------------|
  *
+ * **NOTE** Addresses are shown above in 3-byte address mode.  Parts larger
+ * than 16MB (e.g., `w25q256jv`) are switched to 4-byte address mode by
+ * `begin()`, in which each address is preceded by `A31-A24` (see
+ * `SpiFlashBase::command()`), and `Read Unique ID` takes 5 dummy bytes.
+ *
  * **NOTE** Operations involving multiple reads or writes wrap at addresses
  * modulo 256.
  *
@@ -71,6 +76,8 @@
 class SpiFlashBase {
 protected:
   uint8_t ERROR_CODE_;
+  uint8_t address_bytes_;  // Number of address bytes per instruction (3 or 4).
+  uint32_t capacity_;  // Capacity (in bytes), or 0 if unknown.
 
   virtual void deselect_chip();
   virtual void select_chip();
@@ -78,6 +85,9 @@ protected:
 
   void set_error(uint8_t error_code) { ERROR_CODE_ = error_code; }
 
+  // Shift out instruction and address (chip must be selected).
+  void command(uint8_t instruction, uint32_t address);
+  void detect_addressing();
   bool erase(uint32_t address, uint8_t code, uint32_t settling_time_ms);
 public:
   static const uint8_t SPI__DUMMY             = 0x00;
@@ -117,26 +127,47 @@ public:
   static const uint8_t INSTR__POWER_DOWN             = 0xB9;
   static const uint8_t INSTR__RELEASE_POWERDOWN_ID   = 0xAB;
 
+  /* Address mode instructions for parts larger than 16MB (see "Instruction
+   * Set Table 1" in `w25q256jv` datasheet). */
+  static const uint8_t INSTR__READ_STATUS_REGISTER_3    = 0x15;
+  static const uint8_t INSTR__ENTER_4_BYTE_ADDRESS_MODE = 0xB7;
+  static const uint8_t INSTR__EXIT_4_BYTE_ADDRESS_MODE  = 0xE9;
+
   /* See "Figure 4a. Status Register-1" in [datasheet][1].
    *
    * [1]: https://cdn.sparkfun.com/datasheets/Dev/Teensy/w25q64fv.pdf
    */
   static const uint8_t STATUS__BUSY         = 0b00000001;
   static const uint8_t STATUS__WRITE_ENABLE = 0b00000010;
+  // Current address mode (`ADS`) bit in status register 3 (set: 4-byte).
+  static const uint8_t STATUS3__ADDRESS_MODE = 0b00000001;
+
+  /* SFDP signature and supported address modes (see "JEDEC Basic Flash
+   * Parameter Table: 1st DWORD" in JEDEC `JESD216`). */
+  static const uint32_t SFDP__SIGNATURE          = 0x50444653;  // "SFDP"
+  static const uint8_t SFDP__ADDRESS_3_BYTE      = 0b00;
+  static const uint8_t SFDP__ADDRESS_3_OR_4_BYTE = 0b01;
+  static const uint8_t SFDP__ADDRESS_4_BYTE      = 0b10;
+
+  // Program page and erase sector sizes (in bytes).
+  static const uint32_t PAGE_SIZE   = 256;
+  static const uint32_t SECTOR_SIZE = 4096;
 
   uint8_t cs_pin_;  // Chip select pin should connect to `/CS` pin on chip
   uint8_t device_id_;
   uint8_t manufacturer_id_;
 
   static const uint8_t TIMEOUT_ERROR = 0x10;
+  static const uint8_t ADDRESS_MODE_ERROR = 0x11;
 
   bool disable_write();
   bool enable_write();
 
-  SpiFlashBase() : ERROR_CODE_(0), cs_pin_(0), device_id_(0),
-                   manufacturer_id_(0) {}
-  SpiFlashBase(uint8_t cs_pin) : ERROR_CODE_(0), cs_pin_(cs_pin),
-                                 device_id_(0), manufacturer_id_(0) {}
+  SpiFlashBase() : ERROR_CODE_(0), address_bytes_(3), capacity_(0),
+                   cs_pin_(0), device_id_(0), manufacturer_id_(0) {}
+  SpiFlashBase(uint8_t cs_pin) : ERROR_CODE_(0), address_bytes_(3),
+                                 capacity_(0), cs_pin_(cs_pin), device_id_(0),
+                                 manufacturer_id_(0) {}
 
   virtual void begin();
   virtual void begin(uint8_t cs_pin);
@@ -146,6 +177,14 @@ public:
 
   uint8_t status_register1();
   uint8_t status_register2();
+  uint8_t status_register3();
+
+  uint8_t address_bytes() const { return address_bytes_; }
+  /* Capacity (in bytes) detected by `begin()`, or 0 if unknown.  Limited to
+   * 16MB if 4-byte address mode could not be entered. */
+  uint32_t capacity() const { return capacity_; }
+  bool enter_4_byte_address_mode();
+  bool exit_4_byte_address_mode();
 
   bool ready();
   bool ready_wait(uint32_t timeout=100L);
@@ -156,9 +195,16 @@ public:
   bool erase_chip();
   bool write_page(uint32_t address, uint8_t *src, uint32_t length);
   bool write_page(uint32_t address, UInt8Array src);
+  // Write any number of bytes, split into page program operations.
+  bool write(uint32_t address, uint8_t *src, uint32_t length);
+  // Check that all bytes in range are erased (i.e., `0xFF`).
+  bool is_blank(uint32_t address, uint32_t length);
+  // Check that all bits cleared in `src` read back as cleared.
+  bool is_programmed(uint32_t address, uint8_t *src, uint32_t length);
 
   uint32_t jedec_id();
   uint64_t read_unique_id();
+  void read_sfdp(uint32_t address, uint8_t *dst, uint32_t length);
   uint8_t read_sfdp_register(uint8_t address);
   bool erase_sector(uint32_t address);
   bool erase_block_32KB(uint32_t address);
@@ -0,0 +1,593 @@
+#include "SpiFlashHealth.h"
+#include "SpiFlashRecord.h"
+
+
+// Rotate-and-add checksum over table payload.
+static uint32_t update_checksum(uint32_t checksum, uint8_t value) {
+  return ((checksum << 1) | (checksum >> 31)) + value;
+}
+
+
+/* Byte `i` of serialized table payload:
+ *
+ *     [sector map (2 * logical)][erase counts (4 * physical)]
+ *     [sector status (physical)]
+ */
+uint8_t SpiFlashHealthBase::table_byte(uint32_t i) const {
+  if (i < 2UL * logical_sectors_) {
+    return sector_map_[i / 2] >> (8 * (i % 2));
+  }
+  i -= 2UL * logical_sectors_;
+  if (i < 4UL * physical_sectors_) {
+    return erase_counts_[i / 4] >> (8 * (i % 4));
+  }
+  i -= 4UL * physical_sectors_;
+  return status_[i];
+}
+
+void SpiFlashHealthBase::set_table_byte(uint32_t i, uint8_t value) {
+  if (i < 2UL * logical_sectors_) {
+    uint16_t &sector = sector_map_[i / 2];
+    if (i % 2 == 0) { sector = 0; }
+    sector |= static_cast<uint16_t>(value) << (8 * (i % 2));
+    return;
+  }
+  i -= 2UL * logical_sectors_;
+  if (i < 4UL * physical_sectors_) {
+    uint32_t &count = erase_counts_[i / 4];
+    if (i % 4 == 0) { count = 0; }
+    count |= static_cast<uint32_t>(value) << (8 * (i % 4));
+    return;
+  }
+  i -= 4UL * physical_sectors_;
+  status_[i] = value;
+}
+
+/* Read header of table `slot` into `state`, returning `false` if flash could
+ * not be read (i.e., header state is unknown). */
+bool SpiFlashHealthBase::read_header(uint32_t slot, uint8_t &state,
+                                     uint32_t &sequence, uint32_t &checksum) {
+  uint8_t header[HEADER_SIZE];
+
+  if (!flash_.read(slot_address(slot), header, sizeof(header))) {
+    return false;
+  }
+  sequence = spi_flash_unpack(&header[4], 4);
+  checksum = spi_flash_unpack(&header[12], 4);
+  if (spi_flash_unpack(&header[0], 4) != MAGIC) {
+    state = HEADER__INVALID;
+  } else if (spi_flash_unpack(&header[8], 2) != logical_sectors_ ||
+             spi_flash_unpack(&header[10], 2) != physical_sectors_) {
+    state = HEADER__LAYOUT;
+  } else {
+    state = HEADER__VALID;
+  }
+  return true;
+}
+
+/* Load table payload into `valid` (i.e., `false` if checksum does not match),
+ * returning `false` if flash could not be read. */
+bool SpiFlashHealthBase::read_table(uint32_t slot, uint32_t checksum,
+                                    bool &valid) {
+  const uint32_t address = slot_address(slot) + HEADER_SIZE;
+  const uint32_t length = payload_size();
+  uint8_t buffer[32];
+  uint32_t actual = 0;
+
+  for (uint32_t i = 0; i < length; i += sizeof(buffer)) {
+    uint32_t count = length - i;
+    if (count > sizeof(buffer)) { count = sizeof(buffer); }
+    if (!flash_.read(address + i, buffer, count)) { return false; }
+    for (uint32_t j = 0; j < count; j++) {
+      set_table_byte(i + j, buffer[j]);
+      actual = update_checksum(actual, buffer[j]);
+    }
+  }
+  valid = (actual == checksum);
+
+  // Reject sector map entries outside the physical pool.
+  for (uint16_t i = 0; i < logical_sectors_ && valid; i++) {
+    if (sector_map_[i] >= physical_sectors_) { valid = false; }
+  }
+  return true;
+}
+
+/* Map each logical sector to the same physical sector, with the remaining
+ * physical sectors as spares. */
+void SpiFlashHealthBase::reset_table() {
+  for (uint16_t i = 0; i < physical_sectors_; i++) {
+    erase_counts_[i] = 0;
+    if (i < logical_sectors_) {
+      sector_map_[i] = i;
+      status_[i] = 0;
+    } else {
+      status_[i] = SECTOR__SPARE;
+    }
+  }
+}
+
+void SpiFlashHealthBase::record_failure(uint16_t physical) {
+  if ((status_[physical] & SECTOR__FAILURES) < SECTOR__FAILURES) {
+    status_[physical]++;
+  }
+}
+
+// Least-erased spare sector (or `NO_SECTOR` if none remain).
+uint16_t SpiFlashHealthBase::find_spare() const {
+  uint16_t spare = NO_SECTOR;
+
+  for (uint16_t i = 0; i < physical_sectors_; i++) {
+    if ((status_[i] & (SECTOR__SPARE | SECTOR__RETIRED)) != SECTOR__SPARE) {
+      continue;
+    }
+    if (spare == NO_SECTOR || erase_counts_[i] < erase_counts_[spare]) {
+      spare = i;
+    }
+  }
+  return spare;
+}
+
+uint16_t SpiFlashHealthBase::spare_count() const {
+  uint16_t count = 0;
+
+  for (uint16_t i = 0; i < physical_sectors_; i++) {
+    if ((status_[i] & (SECTOR__SPARE | SECTOR__RETIRED)) == SECTOR__SPARE) {
+      count++;
+    }
+  }
+  return count;
+}
+
+/*
+ * # Erase check #
+ *
+ * Sampled mode checks the start of each page, so a sector with any page
+ * left unerased is (most likely) detected at 1/16th of the bus cost of a
+ * full check.
+ */
+bool SpiFlashHealthBase::verify_erase(uint16_t physical) {
+  const uint32_t address = sector_address(physical);
+  bool blank = true;
+
+  if (verify_mode_ == VERIFY__FULL) {
+    blank = flash_.is_blank(address, SpiFlashBase::SECTOR_SIZE);
+  } else if (verify_mode_ == VERIFY__SAMPLED) {
+    for (uint32_t i = 0; blank && i < SpiFlashBase::SECTOR_SIZE;
+         i += SpiFlashBase::PAGE_SIZE) {
+      blank = flash_.is_blank(address + i, SAMPLE_SIZE);
+    }
+  }
+  if (!blank) {
+    set_error(flash_.error_code() ? FLASH_ERROR : VERIFY_ERROR);
+  }
+  return blank;
+}
+
+bool SpiFlashHealthBase::verify_program(uint32_t address, uint8_t *src,
+                                        uint32_t length) {
+  bool programmed = true;
+
+  if (verify_mode_ == VERIFY__FULL ||
+      (verify_mode_ == VERIFY__SAMPLED && length <= 2 * SAMPLE_SIZE)) {
+    programmed = flash_.is_programmed(address, src, length);
+  } else if (verify_mode_ == VERIFY__SAMPLED) {
+    const uint32_t tail = length - SAMPLE_SIZE;
+    programmed = (flash_.is_programmed(address, src, SAMPLE_SIZE) &&
+                  flash_.is_programmed(address + tail, src + tail,
+                                       SAMPLE_SIZE));
+  }
+  if (!programmed) {
+    set_error(flash_.error_code() ? FLASH_ERROR : VERIFY_ERROR);
+  }
+  return programmed;
+}
+
+/* Wait for any previous operation to complete (and clear flash error), so
+ * that a timeout of the next erase or program is due to that operation (see
+ * `operation_failed()`). */
+bool SpiFlashHealthBase::wait_ready() {
+  flash_.clear_error();
+  if (!flash_.ready_wait()) {
+    set_error(FLASH_ERROR);
+    return false;
+  }
+  return true;
+}
+
+/*
+ * # Failed erase or program #
+ *
+ * An erase or program that runs past its time limit (i.e., `TIMEOUT_ERROR`)
+ * is a typical sign of a worn sector.  Once the chip is ready again, the
+ * timeout is reported as `VERIFY_ERROR`, so it is counted, retried and
+ * remapped in the same way as a failed check.
+ *
+ * Any other failure (including a chip that stays busy) is a `FLASH_ERROR`.
+ */
+bool SpiFlashHealthBase::operation_failed() {
+  if (flash_.error_code() == SpiFlashBase::TIMEOUT_ERROR &&
+      flash_.ready_wait(RECOVERY_TIMEOUT)) {
+    set_error(VERIFY_ERROR);
+  } else {
+    set_error(FLASH_ERROR);
+  }
+  return false;
+}
+
+bool SpiFlashHealthBase::erase_physical(uint16_t physical) {
+  if (!wait_ready()) { return false; }
+  erase_counts_[physical]++;
+  pending_erases_++;
+  if (!flash_.erase_sector(sector_address(physical))) {
+    return operation_failed();
+  }
+  return verify_erase(physical);
+}
+
+/* Copy contents of (failed) sector `from` to erased sector `to`, applying the
+ * failed program of `length` bytes from `src` at `offset`.
+ *
+ * **NOTE** Page program can only clear bits, so the intended value of each
+ * byte of the failed program is the previous value AND the `src` value. */
+bool SpiFlashHealthBase::copy_sector(uint16_t from, uint16_t to,
+                                     uint32_t offset, uint8_t *src,
+                                     uint32_t length) {
+  const uint32_t from_address = sector_address(from);
+  const uint32_t to_address = sector_address(to);
+  uint8_t buffer[32];
+
+  for (uint32_t i = 0; i < SpiFlashBase::SECTOR_SIZE; i += sizeof(buffer)) {
+    if (!flash_.read(from_address + i, buffer, sizeof(buffer))) {
+      set_error(FLASH_ERROR);
+      return false;
+    }
+    bool blank = true;
+    for (uint32_t j = 0; j < sizeof(buffer); j++) {
+      const uint32_t k = i + j;
+      if (k >= offset && k < offset + length) { buffer[j] &= src[k - offset]; }
+      if (buffer[j] != 0xFF) { blank = false; }
+    }
+    if (blank) { continue; }
+    if (!wait_ready()) { return false; }
+    if (!flash_.write_page(to_address + i, buffer, sizeof(buffer))) {
+      return operation_failed();
+    }
+    if (!flash_.is_programmed(to_address + i, buffer, sizeof(buffer))) {
+      set_error(flash_.error_code() ? FLASH_ERROR : VERIFY_ERROR);
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * # Remap logical sector #
+ *
+ *  1. Erase least-erased spare (and copy contents of failed sector, if
+ *     `copy` is set).  Retire spare and repeat if it also fails.
+ *  2. Map `sector` to spare, retire failed sector, and sync table.
+ *
+ * The failed sector is only retired once `sector` is remapped.  If no spare
+ * is left (or flash cannot be accessed), `sector` stays mapped to the failed
+ * sector, with its failure recorded (see `failure_count()`).
+ */
+bool SpiFlashHealthBase::relocate(uint16_t sector, bool copy, uint32_t offset,
+                                  uint8_t *src, uint32_t length) {
+  const uint16_t failed = sector_map_[sector];
+
+  while (true) {
+    const uint16_t spare = find_spare();
+    if (spare == NO_SECTOR) {
+      sync();
+      set_error(NO_SPARE_ERROR);
+      return false;
+    }
+
+    status_[spare] &= ~SECTOR__SPARE;
+    if (erase_physical(spare) &&
+        (!copy || copy_sector(failed, spare, offset, src, length))) {
+      sector_map_[sector] = spare;
+      status_[failed] |= SECTOR__RETIRED;
+      return sync();
+    } else if (error_code() != VERIFY_ERROR) {
+      status_[spare] |= SECTOR__SPARE;
+      return false;
+    }
+    record_failure(spare);
+    status_[spare] |= SECTOR__RETIRED;
+  }
+}
+
+bool SpiFlashHealthBase::begin(uint32_t base_address,
+                               uint16_t table_sectors) {
+  base_address_ = base_address;
+  table_sectors_ = table_sectors;
+  pending_erases_ = 0;
+
+  // Round slots up to whole pages, or to whole sectors if table is larger
+  // than a sector.
+  const uint32_t table_size = HEADER_SIZE + payload_size();
+  const uint32_t align = ((table_size > SpiFlashBase::SECTOR_SIZE)
+                          ? SpiFlashBase::SECTOR_SIZE
+                          : SpiFlashBase::PAGE_SIZE);
+  slot_size_ = (table_size + align - 1) / align * align;
+  const uint32_t units = (static_cast<uint32_t>(table_sectors) *
+                          SpiFlashBase::SECTOR_SIZE / table_unit_size());
+  table_slots_ = units * unit_slots();
+
+  if ((base_address % SpiFlashBase::SECTOR_SIZE) || logical_sectors_ == 0 ||
+      physical_sectors_ < logical_sectors_ ||
+      physical_sectors_ >= NO_SECTOR || units < 2) {
+    set_error(LAYOUT_ERROR);
+    return false;
+  }
+
+  /* Try most recent valid slot first, falling back to the next most recent
+   * slot (i.e., before `bound`) if the table payload is corrupt.
+   *
+   * Fail (rather than initializing a new table) if any slot cannot be read,
+   * or if a slot holds a table for a different layout. */
+  bool bounded = false;
+  uint32_t bound = 0;
+  while (true) {
+    uint32_t newest = table_slots_;
+    uint32_t newest_sequence = 0;
+    uint32_t newest_checksum = 0;
+
+    for (uint32_t slot = 0; slot < table_slots_; slot++) {
+      uint8_t state;
+      uint32_t sequence;
+      uint32_t checksum;
+      if (!read_header(slot, state, sequence, checksum)) {
+        set_error(FLASH_ERROR);
+        return false;
+      } else if (state == HEADER__LAYOUT) {
+        set_error(LAYOUT_ERROR);
+        return false;
+      } else if (state == HEADER__INVALID ||
+                 (bounded && !spi_flash_newer(bound, sequence))) {
+        continue;
+      }
+      if (newest == table_slots_ ||
+          spi_flash_newer(sequence, newest_sequence)) {
+        newest = slot;
+        newest_sequence = sequence;
+        newest_checksum = checksum;
+      }
+    }
+    if (newest == table_slots_) { break; }
+
+    bool valid;
+    if (!read_table(newest, newest_checksum, valid)) {
+      set_error(FLASH_ERROR);
+      return false;
+    } else if (valid) {
+      table_slot_ = newest;
+      sequence_ = newest_sequence;
+      clear_error();
+      return true;
+    }
+    bounded = true;
+    bound = newest_sequence;
+  }
+
+  /* Every table slot with a header is corrupt.  Do not initialize a new
+   * table, since that would lose the sector map (and return retired sectors
+   * to use). */
+  if (bounded) {
+    set_error(TABLE_ERROR);
+    return false;
+  }
+
+  reset_table();
+  // Start new ring at slot 0.
+  table_slot_ = table_slots_ - 1;
+  sequence_ = 0;
+  return sync();
+}
+
+/*
+ * # Sync table #
+ *
+ * Starting from the slot after the most recent slot:
+ *
+ *  1. If slot is the first slot of its sector(s), erase sector(s).
+ *  2. Write table to slot (see `write_table()`), skipping to the next slot
+ *     if slot does not read back as written.
+ *
+ * The sector(s) holding the most recent slot are never erased, so the
+ * previous table survives until a new slot is written.
+ */
+bool SpiFlashHealthBase::sync() {
+  const uint32_t current_unit = table_slot_ / unit_slots();
+
+  for (uint32_t i = 1; i < table_slots_; i++) {
+    const uint32_t slot = (table_slot_ + i) % table_slots_;
+
+    if (slot % unit_slots() == 0) {
+      if (slot / unit_slots() == current_unit) { break; }
+      const uint32_t address = slot_address(slot);
+      for (uint32_t j = 0; j < table_unit_size();
+           j += SpiFlashBase::SECTOR_SIZE) {
+        if (!flash_.erase_sector(address + j)) {
+          set_error(FLASH_ERROR);
+          return false;
+        }
+      }
+    }
+    if (write_table(slot)) {
+      table_slot_ = slot;
+      sequence_++;
+      pending_erases_ = 0;
+      clear_error();
+      return true;
+    }
+    if (error_code() != VERIFY_ERROR) { return false; }
+  }
+  set_error(TABLE_ERROR);
+  return false;
+}
+
+/*
+ * # Write table slot #
+ *
+ *  1. Check slot is blank.
+ *  2. Write payload, and check it reads back as written.
+ *  3. Write header (i.e., only mark slot valid once payload is complete),
+ *     and check it reads back as written.
+ *
+ * Table writes are always fully checked, regardless of `verify_mode`.
+ */
+bool SpiFlashHealthBase::write_table(uint32_t slot) {
+  const uint32_t address = slot_address(slot);
+  const uint32_t length = payload_size();
+  uint8_t buffer[32];
+  uint32_t checksum = 0;
+
+  if (!flash_.is_blank(address, HEADER_SIZE + length)) {
+    set_error(flash_.error_code() ? FLASH_ERROR : VERIFY_ERROR);
+    return false;
+  }
+  for (uint32_t i = 0; i < length; i += sizeof(buffer)) {
+    uint32_t count = length - i;
+    if (count > sizeof(buffer)) { count = sizeof(buffer); }
+    for (uint32_t j = 0; j < count; j++) {
+      buffer[j] = table_byte(i + j);
+      checksum = update_checksum(checksum, buffer[j]);
+    }
+    if (!flash_.write(address + HEADER_SIZE + i, buffer, count)) {
+      set_error(FLASH_ERROR);
+      return false;
+    }
+    if (!flash_.is_programmed(address + HEADER_SIZE + i, buffer, count)) {
+      set_error(flash_.error_code() ? FLASH_ERROR : VERIFY_ERROR);
+      return false;
+    }
+  }
+
+  uint8_t header[HEADER_SIZE];
+  spi_flash_pack(&header[0], MAGIC, 4);
+  spi_flash_pack(&header[4], sequence_ + 1, 4);
+  spi_flash_pack(&header[8], logical_sectors_, 2);
+  spi_flash_pack(&header[10], physical_sectors_, 2);
+  spi_flash_pack(&header[12], checksum, 4);
+  if (!flash_.write(address, header, sizeof(header))) {
+    set_error(FLASH_ERROR);
+    return false;
+  }
+  if (!flash_.is_programmed(address, header, sizeof(header))) {
+    set_error(flash_.error_code() ? FLASH_ERROR : VERIFY_ERROR);
+    return false;
+  }
+  return true;
+}
+
+bool SpiFlashHealthBase::read(uint32_t address, uint8_t *dst,
+                              uint32_t length) {
+  if (address + length > size()) {
+    set_error(RANGE_ERROR);
+    return false;
+  }
+  // Split read at sector boundaries, since each sector is mapped separately.
+  while (length > 0) {
+    uint32_t count = (SpiFlashBase::SECTOR_SIZE -
+                      address % SpiFlashBase::SECTOR_SIZE);
+    if (count > length) { count = length; }
+    if (!flash_.read(physical_address(address), dst, count)) {
+      set_error(FLASH_ERROR);
+      return false;
+    }
+    address += count;
+    dst += count;
+    length -= count;
+  }
+  clear_error();
+  return true;
+}
+
+UInt8Array SpiFlashHealthBase::read(uint32_t address, UInt8Array dst) {
+  if (!read(address, dst.data, dst.length)) {
+    dst.data = NULL;
+    dst.length = 0;
+  }
+  return dst;
+}
+
+/*
+ * # Write page #
+ *
+ * Program and verify page, remapping sector (with contents) to a spare if
+ * program times out or verify fails.
+ *
+ * **NOTE** Unlike `SpiFlashBase::write_page()`, writes may not wrap within a
+ * page.
+ */
+bool SpiFlashHealthBase::write_page(uint32_t address, uint8_t *src,
+                                    uint32_t length) {
+  if (address + length > size() ||
+      address % SpiFlashBase::PAGE_SIZE + length > SpiFlashBase::PAGE_SIZE) {
+    set_error(RANGE_ERROR);
+    return false;
+  }
+
+  const uint16_t sector = address / SpiFlashBase::SECTOR_SIZE;
+  const uint32_t physical = physical_address(address);
+  if (!wait_ready()) { return false; }
+  const bool ok = (flash_.write_page(physical, src, length)
+                   ? verify_program(physical, src, length)
+                   : operation_failed());
+  if (!ok) {
+    if (error_code() != VERIFY_ERROR) { return false; }
+    record_failure(sector_map_[sector]);
+    if (!relocate(sector, true, address % SpiFlashBase::SECTOR_SIZE, src,
+                  length)) {
+      return false;
+    }
+  }
+  clear_error();
+  return true;
+}
+
+bool SpiFlashHealthBase::write(uint32_t address, uint8_t *src,
+                               uint32_t length) {
+  while (length > 0) {
+    uint32_t count = (SpiFlashBase::PAGE_SIZE -
+                      address % SpiFlashBase::PAGE_SIZE);
+    if (count > length) { count = length; }
+    if (!write_page(address, src, count)) { return false; }
+    address += count;
+    src += count;
+    length -= count;
+  }
+  return true;
+}
+
+/*
+ * # Erase sector #
+ *
+ *  1. Erase and verify mapped physical sector.
+ *  2. On timeout or verify failure, retry once (a marginal sector may
+ *     complete erase on a second attempt), then remap to a spare.
+ *  3. Sync table if `sync_interval` erases have passed since last sync.
+ */
+bool SpiFlashHealthBase::erase_sector(uint32_t address) {
+  if (address >= size()) {
+    set_error(RANGE_ERROR);
+    return false;
+  }
+
+  const uint16_t sector = address / SpiFlashBase::SECTOR_SIZE;
+  bool ok = erase_physical(sector_map_[sector]);
+  if (!ok && error_code() == VERIFY_ERROR) {
+    record_failure(sector_map_[sector]);
+    ok = erase_physical(sector_map_[sector]);
+    if (!ok && error_code() == VERIFY_ERROR) {
+      record_failure(sector_map_[sector]);
+      ok = relocate(sector, false, 0, NULL, 0);
+    }
+  }
+  if (!ok) { return false; }
+  if (pending_erases_ >= sync_interval_ && !sync()) { return false; }
+  clear_error();
+  return true;
+}
@@ -0,0 +1,229 @@
+#ifndef ___SPI_FLASH_HEALTH__H___
+#define ___SPI_FLASH_HEALTH__H___
+
+
+#include <stdint.h>
+#include <CArrayDefs.h>
+#include "SpiFlashBase.h"
+
+/*
+ * # Sector health and remapping #
+ *
+ * Verifies erase and program results, tracks per-sector erase counts and
+ * failures, and transparently remaps failing sectors to spare sectors.
+ *
+ * Callers address a *logical* region of `logical_sectors` 4KB sectors using
+ * `read()`, `write()`, `write_page()` and `erase_sector()`, as they would
+ * with `SpiFlashBase`.  Each logical sector maps to one *physical* sector in
+ * a pool of `logical_sectors + spare_sectors` sectors.
+ *
+ * ## Layout ##
+ *
+ * The region starts at a sector-aligned `base_address`:
+ *
+ *     |<--- table_sectors --->|
+ *     | slot | slot | ... | slot | physical sector 0 | ... | sector N-1 |
+ *
+ * The table sectors hold a ring of table *slots*.  Each slot holds one
+ * snapshot of the table: a 16-byte header followed by the table payload:
+ *
+ *     header:  [magic (4)][sequence (4)][logical (2)][physical (2)]
+ *              [checksum (4)]
+ *     payload: [sector map (2 * logical)][erase counts (4 * physical)]
+ *              [sector status (physical)]
+ *
+ * Slots are rounded up to a whole number of pages, so several slots share
+ * each sector (or, for a table larger than a sector, to whole sectors).
+ *
+ * `sync()` writes the table to the next slot in the ring, erasing a sector
+ * only as the ring first enters it, and skips any slot that does not read
+ * back as written.  Table sector erases are thereby spread over the ring,
+ * and the most recent valid slot (by sequence number and checksum) survives
+ * power loss during `sync()`.  The table is synced after every remap and
+ * after every `sync_interval` erases, so at most `sync_interval` erase counts
+ * are lost on power loss.
+ *
+ * ## Verification ##
+ *
+ * Results are checked by streaming reads, with cost set by `verify_mode`:
+ *
+ *  - `VERIFY__NONE`: no checks.
+ *  - `VERIFY__SAMPLED` (default): erase checks the first `SAMPLE_SIZE` bytes
+ *    of each page; program checks the first and last `SAMPLE_SIZE` bytes
+ *    written.
+ *  - `VERIFY__FULL`: every byte is checked.
+ *
+ * An erase or program that times out (e.g., a worn sector taking longer than
+ * the erase time limit) counts as a failed check.
+ *
+ * A sector that fails to erase twice, or that fails a program check, is
+ * retired once its logical sector is remapped to the least-erased spare
+ * (after copying existing contents, for a program failure).  If no spare is
+ * left, the operation fails with `NO_SPARE_ERROR` and the logical sector
+ * stays mapped to the failing sector.
+ *
+ * See `SpiFlashRecord.h` for field encoding.
+ */
+
+class SpiFlashHealthBase {
+public:
+  static const uint32_t MAGIC       = 0x31544C48;  // "HLT1"
+  static const uint32_t HEADER_SIZE = 16;
+  static const uint32_t SAMPLE_SIZE = 16;
+  // Time to wait for chip to recover from a timed out erase or program (ms).
+  static const uint32_t RECOVERY_TIMEOUT = 1000;
+  static const uint16_t NO_SECTOR   = 0xFFFF;
+
+  static const uint8_t VERIFY__NONE    = 0;
+  static const uint8_t VERIFY__SAMPLED = 1;
+  static const uint8_t VERIFY__FULL    = 2;
+
+  // Physical sector status bits.
+  static const uint8_t SECTOR__RETIRED  = 0b10000000;
+  static const uint8_t SECTOR__SPARE    = 0b01000000;
+  static const uint8_t SECTOR__FAILURES = 0b00111111;
+
+  static const uint8_t FLASH_ERROR    = 0x30;
+  static const uint8_t RANGE_ERROR    = 0x31;
+  static const uint8_t NO_SPARE_ERROR = 0x32;
+  static const uint8_t LAYOUT_ERROR   = 0x33;
+  static const uint8_t VERIFY_ERROR   = 0x34;
+  static const uint8_t TABLE_ERROR    = 0x35;
+protected:
+  uint8_t ERROR_CODE_;
+  SpiFlashBase &flash_;
+  uint16_t *sector_map_;  // Physical sector of each logical sector.
+  uint32_t *erase_counts_;  // Erase count of each physical sector.
+  uint8_t *status_;  // Status of each physical sector.
+  uint16_t logical_sectors_;
+  uint16_t physical_sectors_;
+
+  uint32_t base_address_;
+  uint16_t table_sectors_;  // Sectors in table slot ring.
+  uint32_t slot_size_;  // Bytes per table slot.
+  uint32_t table_slots_;  // Number of table slots in ring.
+  uint32_t table_slot_;  // Most recently written table slot.
+  uint32_t sequence_;
+  uint8_t verify_mode_;
+  uint16_t sync_interval_;
+  uint16_t pending_erases_;  // Erases since last `sync()`.
+
+  void set_error(uint8_t error_code) { ERROR_CODE_ = error_code; }
+
+  // Bytes erased together for table slots (i.e., at least one sector).
+  uint32_t table_unit_size() const {
+    return (slot_size_ > SpiFlashBase::SECTOR_SIZE) ? slot_size_
+                                                    : SpiFlashBase::SECTOR_SIZE;
+  }
+  uint32_t unit_slots() const { return table_unit_size() / slot_size_; }
+  uint32_t slot_address(uint32_t slot) const {
+    return (base_address_ + slot / unit_slots() * table_unit_size() +
+            slot % unit_slots() * slot_size_);
+  }
+  uint32_t sector_address(uint16_t physical) const {
+    return (base_address_ +
+            (table_sectors_ + physical) * SpiFlashBase::SECTOR_SIZE);
+  }
+  uint32_t payload_size() const {
+    return 2UL * logical_sectors_ + 5UL * physical_sectors_;
+  }
+
+  uint8_t table_byte(uint32_t i) const;
+  void set_table_byte(uint32_t i, uint8_t value);
+  // Table slot header states (see `read_header()`).
+  static const uint8_t HEADER__INVALID = 0;
+  static const uint8_t HEADER__VALID   = 1;
+  static const uint8_t HEADER__LAYOUT  = 2;  // Valid, but different layout.
+
+  bool read_header(uint32_t slot, uint8_t &state, uint32_t &sequence,
+                   uint32_t &checksum);
+  bool read_table(uint32_t slot, uint32_t checksum, bool &valid);
+  bool write_table(uint32_t slot);
+  void reset_table();
+
+  void record_failure(uint16_t physical);
+  uint16_t find_spare() const;
+  bool verify_erase(uint16_t physical);
+  bool verify_program(uint32_t address, uint8_t *src, uint32_t length);
+  bool wait_ready();
+  bool operation_failed();
+  bool erase_physical(uint16_t physical);
+  bool copy_sector(uint16_t from, uint16_t to, uint32_t offset, uint8_t *src,
+                   uint32_t length);
+  bool relocate(uint16_t sector, bool copy, uint32_t offset, uint8_t *src,
+                uint32_t length);
+public:
+  SpiFlashHealthBase(SpiFlashBase &flash, uint16_t *sector_map,
+                     uint32_t *erase_counts, uint8_t *status,
+                     uint16_t logical_sectors, uint16_t physical_sectors)
+    : ERROR_CODE_(0), flash_(flash), sector_map_(sector_map),
+      erase_counts_(erase_counts), status_(status),
+      logical_sectors_(logical_sectors), physical_sectors_(physical_sectors),
+      base_address_(0), table_sectors_(0), slot_size_(0), table_slots_(0),
+      table_slot_(0), sequence_(0),
+      verify_mode_(VERIFY__SAMPLED), sync_interval_(32), pending_erases_(0) {}
+
+  /* Load most recent valid table from flash region starting at
+   * (sector-aligned) `base_address`, or initialize a new table if no slot
+   * holds a table header.
+   *
+   * Fails without initializing a new table if a slot cannot be read
+   * (`FLASH_ERROR`), holds a table for different layout arguments
+   * (`LAYOUT_ERROR`), or if every table found is corrupt (`TABLE_ERROR`).
+   *
+   * The first `table_sectors` sectors of the region hold the table slot ring
+   * (at least two sectors, or two table sizes, if larger). */
+  bool begin(uint32_t base_address, uint16_t table_sectors=4);
+  // Write table to flash.
+  bool sync();
+
+  void set_verify_mode(uint8_t verify_mode) { verify_mode_ = verify_mode; }
+  uint8_t verify_mode() const { return verify_mode_; }
+  // Number of erases between automatic `sync()` calls.
+  void set_sync_interval(uint16_t interval) { sync_interval_ = interval; }
+
+  bool read(uint32_t address, uint8_t *dst, uint32_t length);
+  UInt8Array read(uint32_t address, UInt8Array dst);
+  bool write_page(uint32_t address, uint8_t *src, uint32_t length);
+  bool write(uint32_t address, uint8_t *src, uint32_t length);
+  bool erase_sector(uint32_t address);
+
+  // Size of logical region (in bytes).
+  uint32_t size() const {
+    return logical_sectors_ * SpiFlashBase::SECTOR_SIZE;
+  }
+  // Flash address currently mapped to logical `address`.
+  uint32_t physical_address(uint32_t address) const {
+    return (sector_address(sector_map_[address / SpiFlashBase::SECTOR_SIZE]) +
+            address % SpiFlashBase::SECTOR_SIZE);
+  }
+  uint32_t erase_count(uint16_t sector) const {
+    return erase_counts_[sector_map_[sector]];
+  }
+  uint8_t failure_count(uint16_t sector) const {
+    return status_[sector_map_[sector]] & SECTOR__FAILURES;
+  }
+  uint16_t spare_count() const;
+
+  uint8_t error_code() const { return ERROR_CODE_; }
+  void clear_error() { set_error(0); }
+};
+
+
+/* Health layer for `LogicalSectors` sectors, backed by `SpareSectors`
+ * additional spare sectors. */
+template <uint16_t LogicalSectors, uint16_t SpareSectors>
+class SpiFlashHealth : public SpiFlashHealthBase {
+protected:
+  uint16_t sector_map_storage_[LogicalSectors];
+  uint32_t erase_count_storage_[LogicalSectors + SpareSectors];
+  uint8_t status_storage_[LogicalSectors + SpareSectors];
+public:
+  SpiFlashHealth(SpiFlashBase &flash)
+    : SpiFlashHealthBase(flash, sector_map_storage_, erase_count_storage_,
+                         status_storage_, LogicalSectors,
+                         LogicalSectors + SpareSectors) {}
+};
+
+
+#endif  // #ifndef ___SPI_FLASH_HEALTH__H___
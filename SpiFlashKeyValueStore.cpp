@@ -0,0 +1,488 @@
+#include "SpiFlashKeyValueStore.h"
+#include "SpiFlashRecord.h"
+
+
+/* Check value for header/entry fields, used to discard records that were
+ * only partially programmed (e.g., due to power loss). */
+static uint16_t check(uint32_t a, uint32_t b, uint16_t c) {
+  return ~(a ^ (a >> 16) ^ b ^ (b >> 16) ^ c);
+}
+
+static bool is_erased(const uint8_t *src, uint32_t length) {
+  for (uint32_t i = 0; i < length; i++) {
+    if (src[i] != 0xFF) { return false; }
+  }
+  return true;
+}
+
+
+uint16_t SpiFlashKeyValueStoreBase::home(uint32_t key) const {
+  // Multiplicative (Fibonacci) hash, to spread sequential keys.
+  return static_cast<uint32_t>(key * 2654435761UL) % slot_count_;
+}
+
+SpiFlashKeyValueStoreBase::Slot *SpiFlashKeyValueStoreBase::find(uint32_t key) {
+  uint16_t i = home(key);
+  for (uint16_t probes = 0; probes < slot_count_; probes++) {
+    Slot &slot = slots_[i];
+    if (slot.address == EMPTY) { return NULL; }
+    if (slot.key == key) { return &slot; }
+    i = (i + 1) % slot_count_;
+  }
+  return NULL;
+}
+
+/* Claim an unused slot for `key`.
+ *
+ * **NOTE** Caller must check that `key` is not already present and that
+ * `size() < capacity()`. */
+SpiFlashKeyValueStoreBase::Slot *
+SpiFlashKeyValueStoreBase::insert(uint32_t key) {
+  uint16_t i = home(key);
+  while (slots_[i].address != EMPTY) { i = (i + 1) % slot_count_; }
+  slots_[i].key = key;
+  slots_[i].length = 0;
+  key_count_++;
+  return &slots_[i];
+}
+
+void SpiFlashKeyValueStoreBase::set_value(Slot *slot, uint32_t address,
+                                          uint16_t length) {
+  live_bytes_ = live_bytes_ - slot->length + length;
+  slot->address = address;
+  slot->length = length;
+}
+
+/* Release slot, shifting later slots in the same probe sequence back so that
+ * linear probing never stops early at the released slot. */
+void SpiFlashKeyValueStoreBase::remove_slot(Slot *slot) {
+  uint16_t i = slot - slots_;
+  uint16_t j = i;
+
+  live_bytes_ -= slot->length;
+
+  while (true) {
+    j = (j + 1) % slot_count_;
+    if (slots_[j].address == EMPTY) { break; }
+    const uint16_t k = home(slots_[j].key);
+    // Slot `j` may only move back if its home is not in cyclic range `(i, j]`.
+    const bool in_range = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+    if (!in_range) {
+      slots_[i] = slots_[j];
+      i = j;
+    }
+  }
+  slots_[i].address = EMPTY;
+  key_count_--;
+}
+
+void SpiFlashKeyValueStoreBase::clear_slots() {
+  for (uint16_t i = 0; i < slot_count_; i++) { slots_[i].address = EMPTY; }
+  key_count_ = 0;
+  live_bytes_ = 0;
+}
+
+/* Read header of `bank` into `state`, returning `false` if flash could not
+ * be read (i.e., header state is unknown). */
+bool SpiFlashKeyValueStoreBase::read_header(uint8_t bank, uint8_t &state,
+                                            uint32_t &sequence) {
+  uint8_t header[HEADER_ENTRIES * ENTRY_SIZE];
+
+  if (!flash_.read(bank_address(bank), header, sizeof(header))) {
+    return false;
+  }
+  const uint32_t magic = spi_flash_unpack(&header[0], 4);
+  sequence = spi_flash_unpack(&header[4], 4);
+  const uint16_t bank_sectors = spi_flash_unpack(&header[8], 2);
+  const uint16_t index_sectors = spi_flash_unpack(&header[10], 2);
+
+  if (magic != MAGIC || spi_flash_unpack(&header[12], 2) !=
+      check(magic, sequence, bank_sectors ^ index_sectors)) {
+    state = HEADER__INVALID;
+  } else if (bank_sectors != bank_sectors_ ||
+             index_sectors != index_sectors_) {
+    state = HEADER__LAYOUT;
+  } else {
+    state = HEADER__VALID;
+  }
+  return true;
+}
+
+bool SpiFlashKeyValueStoreBase::write_header(uint8_t bank, uint32_t sequence) {
+  uint8_t header[HEADER_ENTRIES * ENTRY_SIZE];
+
+  memset(header, 0xFF, sizeof(header));
+  spi_flash_pack(&header[0], MAGIC, 4);
+  spi_flash_pack(&header[4], sequence, 4);
+  spi_flash_pack(&header[8], bank_sectors_, 2);
+  spi_flash_pack(&header[10], index_sectors_, 2);
+  spi_flash_pack(&header[12],
+                 check(MAGIC, sequence, bank_sectors_ ^ index_sectors_), 2);
+  return flash_.write(bank_address(bank), header, sizeof(header));
+}
+
+bool SpiFlashKeyValueStoreBase::write_entry(uint8_t bank, uint32_t index,
+                                            uint32_t key, uint32_t offset,
+                                            uint16_t length) {
+  uint8_t entry[ENTRY_SIZE];
+
+  spi_flash_pack(&entry[0], key, 4);
+  spi_flash_pack(&entry[4], offset, 4);
+  spi_flash_pack(&entry[8], length, 2);
+  spi_flash_pack(&entry[10], check(key, offset, length), 2);
+  return flash_.write(entry_address(bank, index), entry, sizeof(entry));
+}
+
+/* Program index entry to all zeros, which fails its check (i.e., `load()`
+ * counts and skips it, rather than ending the index there). */
+bool SpiFlashKeyValueStoreBase::invalidate_entry(uint8_t bank,
+                                                 uint32_t index) {
+  uint8_t entry[ENTRY_SIZE];
+
+  memset(entry, 0, sizeof(entry));
+  return flash_.write(entry_address(bank, index), entry, sizeof(entry));
+}
+
+bool SpiFlashKeyValueStoreBase::erase_index(uint8_t bank) {
+  for (uint16_t i = 0; i < index_sectors_; i++) {
+    if (!flash_.erase_sector(bank_address(bank) +
+                             i * SpiFlashBase::SECTOR_SIZE)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Erase each data sector of `bank` that *starts* within offsets
+ * `[start, end)`.
+ *
+ * Since the append position only moves forward, each data sector is erased
+ * exactly once per pass through a bank. */
+bool SpiFlashKeyValueStoreBase::erase_data(uint8_t bank, uint32_t start,
+                                           uint32_t end) {
+  const uint32_t sector_size = SpiFlashBase::SECTOR_SIZE;
+
+  for (uint32_t sector = (start + sector_size - 1) / sector_size;
+       sector * sector_size < end; sector++) {
+    if (!flash_.erase_sector(data_address(bank) + sector * sector_size)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Append value (or tombstone, if `length` is `TOMBSTONE`) and index entry to
+ * active bank, compacting first if the bank is full.
+ *
+ * Compaction erases sectors, so it is skipped if it would not free enough
+ * room (i.e., when the store is full of live values).
+ *
+ * The value is programmed *before* the index entry, so an entry is only ever
+ * found on flash if its value is complete.
+ *
+ * If programming fails, the reserved index entry is invalidated, since an
+ * erased entry would end the index on `begin()` (losing any later entries).
+ * If the entry cannot be invalidated either, writes are refused until the
+ * next successful `begin()`. */
+bool SpiFlashKeyValueStoreBase::append(uint32_t key, uint8_t *src,
+                                       uint16_t length) {
+  const uint32_t data_length = (length == TOMBSTONE) ? 0 : length;
+
+  if (!writable_) {
+    set_error(READ_ONLY_ERROR);
+    return false;
+  }
+  if (!has_room(data_length)) {
+    if (!has_room_compacted(data_length)) {
+      set_error(FULL_ERROR);
+      return false;
+    }
+    if (!compact()) { return false; }
+  }
+
+  const uint32_t offset = append_offset_;
+  /* Advance append position (and index count) *before* programming, so that
+   * bytes from a failed write are never programmed over. */
+  append_offset_ += data_length;
+  index_count_++;
+  if (!erase_data(bank_, offset, append_offset_) ||
+      !flash_.write(data_address(bank_) + offset, src, data_length) ||
+      !write_entry(bank_, index_count_ - 1, key, offset, length)) {
+    if (!invalidate_entry(bank_, index_count_ - 1)) { writable_ = false; }
+    set_error(FLASH_ERROR);
+    return false;
+  }
+  return true;
+}
+
+/*
+ * # Rebuild RAM index #
+ *
+ *  1. Select valid bank with the most recent sequence number (format region
+ *     if neither bank header is valid, but fail if a header cannot be read or
+ *     has a different layout).
+ *  2. Read index entries (in chunks) until the first unprogrammed entry,
+ *     applying each entry to the RAM index in order.
+ *  3. Move append position past any value that was (partially) programmed
+ *     without an index entry (e.g., due to power loss during `put()`).
+ */
+bool SpiFlashKeyValueStoreBase::load() {
+  clear_slots();
+  writable_ = false;
+
+  uint32_t sequences[2];
+  bool valid[2];
+  for (uint8_t bank = 0; bank < 2; bank++) {
+    uint8_t state;
+    if (!read_header(bank, state, sequences[bank])) {
+      set_error(FLASH_ERROR);
+      return false;
+    } else if (state == HEADER__LAYOUT) {
+      set_error(LAYOUT_ERROR);
+      return false;
+    }
+    valid[bank] = (state == HEADER__VALID);
+  }
+  // Only format if both headers were read, and neither is valid.
+  if (!valid[0] && !valid[1]) { return format(); }
+
+  bank_ = spi_flash_newest(valid, sequences, 2);
+  sequence_ = sequences[bank_];
+  index_count_ = 0;
+  append_offset_ = 0;
+
+  const uint32_t index_address = (bank_address(bank_) +
+                                  HEADER_ENTRIES * ENTRY_SIZE);
+  const uint32_t entry_count = index_capacity();
+  uint8_t buffer[8 * ENTRY_SIZE];
+  bool done = false;
+
+  for (uint32_t i = 0; i < entry_count && !done; i += 8) {
+    uint32_t count = entry_count - i;
+    if (count > 8) { count = 8; }
+    if (!flash_.read(index_address + i * ENTRY_SIZE, buffer,
+                     count * ENTRY_SIZE)) {
+      set_error(FLASH_ERROR);
+      return false;
+    }
+    for (uint32_t j = 0; j < count; j++) {
+      const uint8_t *entry = &buffer[j * ENTRY_SIZE];
+      const uint32_t key = spi_flash_unpack(&entry[0], 4);
+      const uint32_t offset = spi_flash_unpack(&entry[4], 4);
+      const uint16_t length = spi_flash_unpack(&entry[8], 2);
+
+      if (is_erased(entry, ENTRY_SIZE)) {
+        // Unprogrammed entry marks end of index.
+        done = true;
+        break;
+      }
+      /* Count and skip partially programmed entry (e.g., an entry spanning
+       * a page boundary, interrupted between its two page programs), so
+       * that it is never programmed over. */
+      index_count_++;
+      if (spi_flash_unpack(&entry[10], 2) != check(key, offset, length)) {
+        continue;
+      }
+
+      Slot *slot = find(key);
+      if (length == TOMBSTONE) {
+        if (slot) { remove_slot(slot); }
+        continue;
+      } else if (offset + length > data_size()) {
+        continue;
+      } else if (!slot) {
+        if (key_count_ >= capacity()) {
+          set_error(FULL_ERROR);
+          return false;
+        }
+        slot = insert(key);
+      }
+      set_value(slot, data_address(bank_) + offset, length);
+      if (offset + length > append_offset_) {
+        append_offset_ = offset + length;
+      }
+    }
+  }
+
+  const uint32_t remainder = append_offset_ % SpiFlashBase::SECTOR_SIZE;
+  if (remainder) {
+    const uint32_t tail = SpiFlashBase::SECTOR_SIZE - remainder;
+    if (!flash_.is_blank(data_address(bank_) + append_offset_, tail)) {
+      if (flash_.error_code()) {
+        set_error(FLASH_ERROR);
+        return false;
+      }
+      // Skip to next sector, which is erased before it is written.
+      append_offset_ += tail;
+    }
+  }
+  writable_ = true;
+  clear_error();
+  return true;
+}
+
+bool SpiFlashKeyValueStoreBase::begin(uint32_t base_address,
+                                      uint16_t bank_sectors,
+                                      uint16_t index_sectors) {
+  base_address_ = base_address;
+  bank_sectors_ = bank_sectors;
+  index_sectors_ = index_sectors;
+
+  if ((base_address % SpiFlashBase::SECTOR_SIZE) || index_sectors == 0 ||
+      bank_sectors <= index_sectors || slot_count_ == 0) {
+    set_error(LAYOUT_ERROR);
+    return false;
+  }
+  return load();
+}
+
+bool SpiFlashKeyValueStoreBase::format() {
+  clear_slots();
+  writable_ = false;
+  // Invalidate bank 1 header and initialize empty bank 0.
+  if (!erase_index(0) || !flash_.erase_sector(bank_address(1)) ||
+      !write_header(0, 0)) {
+    set_error(FLASH_ERROR);
+    return false;
+  }
+  bank_ = 0;
+  sequence_ = 0;
+  index_count_ = 0;
+  append_offset_ = 0;
+  writable_ = true;
+  clear_error();
+  return true;
+}
+
+/*
+ * # Compact #
+ *
+ *  1. Erase index of other bank.
+ *  2. Copy each live value into other bank and write its index entry.
+ *  3. Write header of other bank with next sequence number (i.e., activate
+ *     other bank).
+ *  4. Erase header sector of previous bank.
+ *
+ * On failure, the RAM index is rebuilt from the (still valid) previous bank.
+ * If the rebuild also fails, the RAM index is incomplete, so writes (and
+ * compaction, which would copy only the keys loaded) are refused until the
+ * next successful `begin()`.
+ */
+bool SpiFlashKeyValueStoreBase::compact() {
+  if (!writable_) {
+    set_error(READ_ONLY_ERROR);
+    return false;
+  }
+  if (key_count_ > index_capacity()) {
+    set_error(FULL_ERROR);
+    return false;
+  }
+
+  const uint8_t target = !bank_;
+  uint32_t offset = 0;
+  uint32_t index = 0;
+  uint8_t buffer[32];
+  bool ok = erase_index(target);
+
+  for (uint16_t i = 0; ok && i < slot_count_; i++) {
+    Slot &slot = slots_[i];
+    if (slot.address == EMPTY) { continue; }
+
+    const uint32_t address = data_address(target) + offset;
+    ok = erase_data(target, offset, offset + slot.length);
+    for (uint16_t j = 0; ok && j < slot.length; j += sizeof(buffer)) {
+      uint16_t count = slot.length - j;
+      if (count > sizeof(buffer)) { count = sizeof(buffer); }
+      ok = (flash_.read(slot.address + j, buffer, count) &&
+            flash_.write(address + j, buffer, count));
+    }
+    ok = ok && write_entry(target, index, slot.key, offset, slot.length);
+    slot.address = address;
+    offset += slot.length;
+    index++;
+  }
+
+  if (!ok || !write_header(target, sequence_ + 1)) {
+    // **NOTE** `load()` leaves the store read-only if it fails.
+    load();
+    set_error(FLASH_ERROR);
+    return false;
+  }
+  bank_ = target;
+  sequence_++;
+  index_count_ = index;
+  append_offset_ = offset;
+  /* Previous bank is already superseded by sequence number, so a failure to
+   * erase its header is not an error. */
+  flash_.erase_sector(bank_address(!bank_));
+  clear_error();
+  return true;
+}
+
+bool SpiFlashKeyValueStoreBase::put(uint32_t key, uint8_t *src,
+                                    uint16_t length) {
+  if (length == TOMBSTONE || length > data_size()) {
+    set_error(LENGTH_ERROR);
+    return false;
+  }
+  if (!find(key) && key_count_ >= capacity()) {
+    set_error(FULL_ERROR);
+    return false;
+  }
+  if (!append(key, src, length)) { return false; }
+
+  // **NOTE** `append()` may compact, so look up slot *after* appending.
+  Slot *slot = find(key);
+  if (!slot) { slot = insert(key); }
+  set_value(slot, data_address(bank_) + append_offset_ - length, length);
+  clear_error();
+  return true;
+}
+
+bool SpiFlashKeyValueStoreBase::put(uint32_t key, UInt8Array src) {
+  return put(key, src.data, src.length);
+}
+
+bool SpiFlashKeyValueStoreBase::get(uint32_t key, uint8_t *dst,
+                                    uint16_t length) {
+  Slot *slot = find(key);
+  if (!slot) {
+    set_error(NOT_FOUND_ERROR);
+    return false;
+  }
+  if (length > slot->length) { length = slot->length; }
+  if (!flash_.read(slot->address, dst, length)) {
+    set_error(FLASH_ERROR);
+    return false;
+  }
+  clear_error();
+  return true;
+}
+
+UInt8Array SpiFlashKeyValueStoreBase::get(uint32_t key, UInt8Array dst) {
+  const int32_t value_length = length(key);
+  if (value_length >= 0 && static_cast<uint32_t>(value_length) < dst.length) {
+    dst.length = value_length;
+  }
+  if (!get(key, dst.data, dst.length)) {
+    dst.data = NULL;
+    dst.length = 0;
+  }
+  return dst;
+}
+
+bool SpiFlashKeyValueStoreBase::remove(uint32_t key) {
+  if (!find(key)) {
+    set_error(NOT_FOUND_ERROR);
+    return false;
+  }
+  if (!append(key, NULL, TOMBSTONE)) { return false; }
+  remove_slot(find(key));
+  clear_error();
+  return true;
+}
+
+int32_t SpiFlashKeyValueStoreBase::length(uint32_t key) {
+  Slot *slot = find(key);
+  return slot ? slot->length : -1;
+}
@@ -0,0 +1,201 @@
+#ifndef ___SPI_FLASH_KEY_VALUE_STORE__H___
+#define ___SPI_FLASH_KEY_VALUE_STORE__H___
+
+
+#include <stdint.h>
+#include <CArrayDefs.h>
+#include "SpiFlashBase.h"
+
+/*
+ * # Key-value store #
+ *
+ * Append-only key-value records stored in a region of flash, with an in-RAM
+ * hash index mapping each key to the flash address and length of its most
+ * recent value.  A lookup is therefore a single `read()` of the value bytes.
+ *
+ * ## Layout ##
+ *
+ * The region starts at a sector-aligned `base_address` and is split into two
+ * *banks* of `bank_sectors` 4KB sectors each.  One bank is active at a time:
+ *
+ *     |<------------------------- bank ------------------------->|
+ *     |<------- index_sectors ------->|<--------- data --------->|
+ *     | header | entry | entry | ...  | value | value | ...      |
+ *
+ *  - The *index* holds a 24-byte header followed by one 12-byte entry per
+ *    `put()` or `remove()`:
+ *
+ *        header: [magic (4)][sequence (4)][bank sectors (2)]
+ *                [index sectors (2)][check (2)][reserved (10)]
+ *        entry:  [key (4)][data offset (4)][length (2)][check (2)]
+ *
+ *    A `remove()` entry has a length of `TOMBSTONE`.
+ *  - The *data* area holds raw value bytes, appended in order.  Data sectors
+ *    are erased lazily, as the append position first enters each sector.
+ *
+ * On `begin()`, the RAM index is rebuilt by reading only the index entries of
+ * the active bank (i.e., values are *not* scanned).  Later entries for a key
+ * supersede earlier ones.
+ *
+ * When the index or data area of the active bank is full, live values are
+ * copied into the other bank (see `compact()`).  The other bank only becomes
+ * active once its header is written with the next sequence number, so an
+ * interrupted compaction leaves the original bank intact.
+ *
+ * The region is only formatted by `begin()` if neither bank header is valid.
+ * `begin()` fails (without formatting) if a header cannot be read, or was
+ * written with different layout arguments.
+ *
+ * Writes fail with `READ_ONLY_ERROR` until `begin()` succeeds, and again
+ * after a failed write that could not be recorded in the index.
+ *
+ * See `SpiFlashRecord.h` for field encoding.
+ */
+
+class SpiFlashKeyValueStoreBase {
+public:
+  struct Slot {
+    uint32_t key;
+    uint32_t address;  // Flash address of value (`EMPTY` if slot is unused).
+    uint16_t length;
+  };
+
+  static const uint32_t MAGIC      = 0x3153564B;  // "KVS1"
+  static const uint32_t EMPTY      = 0xFFFFFFFF;
+  static const uint16_t TOMBSTONE  = 0xFFFF;
+  static const uint32_t ENTRY_SIZE = 12;
+  static const uint32_t HEADER_ENTRIES = 2;  // Index entries used by header.
+
+  static const uint8_t FLASH_ERROR     = 0x20;
+  static const uint8_t FULL_ERROR      = 0x21;
+  static const uint8_t NOT_FOUND_ERROR = 0x22;
+  static const uint8_t LENGTH_ERROR    = 0x23;
+  static const uint8_t LAYOUT_ERROR    = 0x24;
+  static const uint8_t READ_ONLY_ERROR = 0x25;
+protected:
+  uint8_t ERROR_CODE_;
+  SpiFlashBase &flash_;
+  Slot *slots_;
+  uint16_t slot_count_;
+  uint16_t key_count_;
+  uint32_t live_bytes_;  // Total length of live values.
+
+  uint32_t base_address_;
+  uint16_t bank_sectors_;
+  uint16_t index_sectors_;
+
+  uint8_t bank_;  // Active bank (0 or 1).
+  uint32_t sequence_;  // Sequence number of active bank.
+  uint32_t index_count_;  // Number of entries in active bank index.
+  uint32_t append_offset_;  // Offset of next value in active data area.
+  bool writable_;  // RAM index and flash index are complete and consistent.
+
+  void set_error(uint8_t error_code) { ERROR_CODE_ = error_code; }
+
+  uint32_t bank_address(uint8_t bank) const {
+    return base_address_ + bank * bank_sectors_ * SpiFlashBase::SECTOR_SIZE;
+  }
+  uint32_t data_address(uint8_t bank) const {
+    return bank_address(bank) + index_sectors_ * SpiFlashBase::SECTOR_SIZE;
+  }
+  uint32_t data_size() const {
+    return (bank_sectors_ - index_sectors_) * SpiFlashBase::SECTOR_SIZE;
+  }
+  uint32_t entry_address(uint8_t bank, uint32_t index) const {
+    // First `HEADER_ENTRIES` entries hold the bank header.
+    return bank_address(bank) + (index + HEADER_ENTRIES) * ENTRY_SIZE;
+  }
+  // Number of entries that fit in index (excluding header).
+  uint32_t index_capacity() const {
+    return (index_sectors_ * SpiFlashBase::SECTOR_SIZE / ENTRY_SIZE -
+            HEADER_ENTRIES);
+  }
+  bool has_room(uint32_t length) const {
+    return (index_count_ < index_capacity() &&
+            append_offset_ + length <= data_size());
+  }
+  /* Active bank would have room after `compact()` (i.e., with only live
+   * index entries and values). */
+  bool has_room_compacted(uint32_t length) const {
+    return (key_count_ < index_capacity() &&
+            live_bytes_ + length <= data_size());
+  }
+
+  uint16_t home(uint32_t key) const;
+  Slot *find(uint32_t key);
+  Slot *insert(uint32_t key);
+  void set_value(Slot *slot, uint32_t address, uint16_t length);
+  void remove_slot(Slot *slot);
+  void clear_slots();
+
+  // Bank header states (see `read_header()`).
+  static const uint8_t HEADER__INVALID = 0;
+  static const uint8_t HEADER__VALID   = 1;
+  static const uint8_t HEADER__LAYOUT  = 2;  // Valid, but different layout.
+
+  bool read_header(uint8_t bank, uint8_t &state, uint32_t &sequence);
+  bool write_header(uint8_t bank, uint32_t sequence);
+  bool write_entry(uint8_t bank, uint32_t index, uint32_t key,
+                   uint32_t offset, uint16_t length);
+  bool invalidate_entry(uint8_t bank, uint32_t index);
+  bool erase_index(uint8_t bank);
+  bool erase_data(uint8_t bank, uint32_t start, uint32_t end);
+  bool append(uint32_t key, uint8_t *src, uint16_t length);
+  bool load();
+public:
+  SpiFlashKeyValueStoreBase(SpiFlashBase &flash, Slot *slots,
+                            uint16_t slot_count)
+    : ERROR_CODE_(0), flash_(flash), slots_(slots), slot_count_(slot_count),
+      key_count_(0), live_bytes_(0), base_address_(0), bank_sectors_(0),
+      index_sectors_(0), bank_(0), sequence_(0), index_count_(0),
+      append_offset_(0), writable_(false) {}
+
+  /* Rebuild RAM index from flash region, formatting the region if it does
+   * not hold a valid bank.
+   *
+   * `base_address` must be sector-aligned.  The region spans
+   * `2 * bank_sectors` sectors, of which `index_sectors` per bank hold the
+   * index. */
+  bool begin(uint32_t base_address, uint16_t bank_sectors,
+             uint16_t index_sectors);
+  // Erase all keys.
+  bool format();
+  /* Copy live values into other bank, discarding superseded records.
+   *
+   * Fails with `READ_ONLY_ERROR` if the RAM index could not be fully loaded
+   * (e.g., after a failed compaction could not rebuild it). */
+  bool compact();
+
+  bool put(uint32_t key, uint8_t *src, uint16_t length);
+  bool put(uint32_t key, UInt8Array src);
+  // Read up to `length` bytes of value.
+  bool get(uint32_t key, uint8_t *dst, uint16_t length);
+  // Read value into `dst`, truncating `dst.length` to value length.
+  UInt8Array get(uint32_t key, UInt8Array dst);
+  bool remove(uint32_t key);
+  bool contains(uint32_t key) { return find(key) != NULL; }
+  // Length of value (or -1 if key is not found).
+  int32_t length(uint32_t key);
+
+  uint16_t size() const { return key_count_; }
+  // Maximum number of keys (keeps hash table at most 75% full).
+  uint16_t capacity() const { return slot_count_ - slot_count_ / 4; }
+
+  uint8_t error_code() const { return ERROR_CODE_; }
+  void clear_error() { set_error(0); }
+};
+
+
+/* Key-value store with RAM index of `SlotCount` hash slots (i.e., up to
+ * `0.75 * SlotCount` keys). */
+template <uint16_t SlotCount>
+class SpiFlashKeyValueStore : public SpiFlashKeyValueStoreBase {
+protected:
+  Slot slot_storage_[SlotCount];
+public:
+  SpiFlashKeyValueStore(SpiFlashBase &flash)
+    : SpiFlashKeyValueStoreBase(flash, slot_storage_, SlotCount) {}
+};
+
+
+#endif  // #ifndef ___SPI_FLASH_KEY_VALUE_STORE__H___
@@ -0,0 +1,51 @@
+#ifndef ___SPI_FLASH_RECORD__H___
+#define ___SPI_FLASH_RECORD__H___
+
+
+#include <stdint.h>
+
+/*
+ * # On-flash record helpers #
+ *
+ * Shared by the on-flash formats in this library (e.g.,
+ * `SpiFlashKeyValueStore`, `SpiFlashHealth`).
+ *
+ * **NOTE** All multi-byte fields are stored little-endian.
+ */
+
+// Store `size` bytes of `value`.
+inline void spi_flash_pack(uint8_t *dst, uint32_t value, uint8_t size) {
+  for (uint8_t i = 0; i < size; i++) { dst[i] = value >> (i * 8); }
+}
+
+// Load `size` bytes.
+inline uint32_t spi_flash_unpack(const uint8_t *src, uint8_t size) {
+  uint32_t value = 0;
+  for (uint8_t i = 0; i < size; i++) {
+    value |= static_cast<uint32_t>(src[i]) << (i * 8);
+  }
+  return value;
+}
+
+// Sequence number `a` is more recent than `b` (allowing for wrap-around).
+inline bool spi_flash_newer(uint32_t a, uint32_t b) {
+  return static_cast<int32_t>(a - b) > 0;
+}
+
+/* Index of valid copy with the most recent sequence number (allowing for
+ * wrap-around), or `count` if no copy is valid. */
+inline uint16_t spi_flash_newest(const bool *valid, const uint32_t *sequences,
+                                 uint16_t count) {
+  uint16_t newest = count;
+
+  for (uint16_t i = 0; i < count; i++) {
+    if (valid[i] &&
+        (newest == count || spi_flash_newer(sequences[i], sequences[newest]))) {
+      newest = i;
+    }
+  }
+  return newest;
+}
+
+
+#endif  // #ifndef ___SPI_FLASH_RECORD__H___
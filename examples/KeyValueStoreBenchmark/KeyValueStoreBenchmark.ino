@@ -0,0 +1,101 @@
+/*
+ * # Key-value store benchmark #
+ *
+ * Time RAM index rebuild (`begin()`) and lookup (`get()`) latency of
+ * `SpiFlashKeyValueStore` with a few thousand keys.
+ *
+ *  1. Fill store with `KEY_COUNT` keys (skipped if already filled).
+ *  2. Time `begin()` (i.e., rebuild of RAM index from flash index).
+ *  3. Time `get()` of every key.
+ *
+ * **NOTE** 4096 hash slots (up to 3072 keys) use 48KB of RAM on 32-bit
+ * boards (e.g., Teensy 3.6/4.x).  Reduce `SLOT_COUNT` and `KEY_COUNT` for
+ * boards with less RAM.
+ *
+ * **WARNING** Sketch erases the first 2MB of flash (i.e., `BASE_ADDRESS`
+ * through `BASE_ADDRESS + 2 * BANK_SECTORS * 4KB`).
+ */
+#include <SPI.h>
+#include <SpiFlash.h>
+#include <SpiFlashKeyValueStore.h>
+
+const uint8_t CS_PIN = 10;
+const uint32_t BASE_ADDRESS = 0;
+const uint16_t BANK_SECTORS = 256;  // 1MB per bank.
+const uint16_t INDEX_SECTORS = 16;  // Up to 5459 index entries per bank.
+const uint16_t SLOT_COUNT = 4096;
+const uint16_t KEY_COUNT = 3000;
+const uint16_t VALUE_LENGTH = 16;
+
+SPISettings spi_settings(20000000, MSBFIRST, SPI_MODE0);
+SpiFlash flash(CS_PIN);
+SpiFlashKeyValueStore<SLOT_COUNT> store(flash);
+
+void fail(const char *message, uint8_t error_code) {
+  Serial.print(message);
+  Serial.print(" (error 0x");
+  Serial.print(error_code, HEX);
+  Serial.println(")");
+  while (true) {}
+}
+
+void setup() {
+  Serial.begin(115200);
+  while (!Serial) {}
+
+  SPI.begin();
+  flash.begin(spi_settings, CS_PIN);
+  Serial.print("JEDEC ID: 0x");
+  Serial.println(flash.jedec_id(), HEX);
+
+  if (!store.begin(BASE_ADDRESS, BANK_SECTORS, INDEX_SECTORS)) {
+    fail("begin() failed", store.error_code());
+  }
+  if (store.size() < KEY_COUNT) {
+    Serial.print("Writing ");
+    Serial.print(KEY_COUNT);
+    Serial.println(" keys...");
+    uint8_t value[VALUE_LENGTH];
+    for (uint16_t key = 0; key < KEY_COUNT; key++) {
+      for (uint16_t i = 0; i < VALUE_LENGTH; i++) { value[i] = key + i; }
+      if (!store.put(key, value, VALUE_LENGTH)) {
+        fail("put() failed", store.error_code());
+      }
+    }
+  }
+
+  // Rebuild RAM index from flash index.
+  uint32_t start = micros();
+  if (!store.begin(BASE_ADDRESS, BANK_SECTORS, INDEX_SECTORS)) {
+    fail("begin() failed", store.error_code());
+  }
+  const uint32_t rebuild_us = micros() - start;
+
+  // Look up every key.
+  uint8_t value[VALUE_LENGTH];
+  uint16_t errors = 0;
+  start = micros();
+  for (uint16_t key = 0; key < KEY_COUNT; key++) {
+    if (!store.get(key, value, VALUE_LENGTH) ||
+        value[VALUE_LENGTH - 1] != static_cast<uint8_t>(key +
+                                                        VALUE_LENGTH - 1)) {
+      errors++;
+    }
+  }
+  const uint32_t lookup_us = micros() - start;
+
+  Serial.print("Keys: ");
+  Serial.println(store.size());
+  Serial.print("begin() (rebuild): ");
+  Serial.print(rebuild_us);
+  Serial.println(" us");
+  Serial.print("get() (mean of ");
+  Serial.print(KEY_COUNT);
+  Serial.print("): ");
+  Serial.print(static_cast<float>(lookup_us) / KEY_COUNT);
+  Serial.println(" us");
+  Serial.print("Lookup errors: ");
+  Serial.println(errors);
+}
+
+void loop() {}